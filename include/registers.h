@@ -127,6 +127,11 @@
 #define BATTERY_STATS_TBATTMIN			0x9d
 #define BATTERY_STSTS_GGJSRCALIB		0xec
 #define BATTERY_STSTS_VCTRLSHORTS		0x9e
+#define BATTERY_STATS_CHARGELEVEL_ADDR	0xf6 // selects the histogram bin, 1 - 10
+#define BATTERY_STATS_CHARGELEVEL_HI	0xf7
+#define BATTERY_STATS_CHARGELEVEL_LO	0xf8
+
+#define BATTERY_STATS_CHARGELEVEL_BINS	10 // charges ending at 10%, 20%, ... 100%
 
 #define MOTOR							0x60
 #define MOTOR_REF_SW					0x20
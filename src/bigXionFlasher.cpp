@@ -62,6 +62,8 @@ BluetoothSerial BTSerial;
 
 #include "driver/gpio.h"
 #include "driver/twai.h"
+#include "esp_timer.h"
+#include <Preferences.h>
 
 #define _NL "\n"
 #define _DEGREE_SIGN "°"
@@ -80,6 +82,146 @@ BluetoothSerial BTSerial;
 #define TIMEOUT_VALUE 80
 #define TIMEOUT_MS 10 // 10ms
 
+#define CPU_FREQ_FULL_MHZ 240
+#define CPU_FREQ_IDLE_MHZ 80 // lowest frequency the Bluetooth controller keeps working at
+#define IDLE_WAKE_MS 1000	 // safety net in case a wake notification gets lost
+#define COMMAND_TIMEOUT_MS 100
+
+#define PIPELINE_DEPTH 4 // reads in flight to one node
+#define SNAPSHOT_MAX_BYTES 4
+#define SNAPSHOT_RETRIES 3
+#define CELL_INVALID 0xffff
+#define MAX_CELLS 20
+#define MAX_PARALLEL 20
+
+#define TX_TIMEOUT_MS 1000
+
+#define CONSOLE_MOUNTAINCAP_MIN_SW 59
+#define BATTERY_CELLMON_MIN_HW 60
+
+#define MONITOR_PERIOD_MS 1000
+#define MONITOR_MIN_PERIOD_MS 100
+#define MONITOR_TIMEOUT_MS 100 // quiet polls give up on a missing reply after this
+#define METRICS_WINDOW 64
+#define METRICS_SHORT_WINDOW 8
+
+enum WakeReason
+{
+	WAKE_BLUETOOTH,
+	WAKE_CAN,
+	WAKE_TIMER,
+	WAKE_REASONS
+};
+
+// Users of wake-on-CAN, see powerSetCanWake()
+#define CAN_WAKE_CAPTURE 0x01
+#define CAN_WAKE_LIVE 0x02
+
+TaskHandle_t loopTask;
+volatile bool clientConnected;
+// Written from the Bluetooth and the CAN receive task, a 64-bit store is not atomic
+portMUX_TYPE wakeEventMux = portMUX_INITIALIZER_UNLOCKED;
+int64_t wakeEventUs;
+WakeReason wakeEventReason;
+volatile uint32_t canWakeUsers;
+
+struct
+{
+	unsigned int count[WAKE_REASONS];
+	unsigned int measured;
+	long long latencySumUs;
+	long long latencyMaxUs;
+} wakeStats;
+
+void powerFullSpeed()
+{
+	if (getCpuFrequencyMhz() != CPU_FREQ_FULL_MHZ)
+		setCpuFrequencyMhz(CPU_FREQ_FULL_MHZ);
+}
+
+void powerIdleSpeed()
+{
+	if (getCpuFrequencyMhz() != CPU_FREQ_IDLE_MHZ)
+		setCpuFrequencyMhz(CPU_FREQ_IDLE_MHZ);
+}
+
+void notifyWake(WakeReason reason)
+{
+	taskENTER_CRITICAL(&wakeEventMux);
+	wakeEventUs = esp_timer_get_time();
+	wakeEventReason = reason;
+	taskEXIT_CRITICAL(&wakeEventMux);
+	xTaskNotifyGive(loopTask);
+}
+
+// Runs in the Bluetooth task after the SPP layer has queued the received data
+void bluetoothEvent(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
+{
+	if (event == ESP_SPP_SRV_OPEN_EVT)
+		clientConnected = true;
+	if (event == ESP_SPP_DATA_IND_EVT || event == ESP_SPP_SRV_OPEN_EVT)
+		notifyWake(WAKE_BLUETOOTH);
+}
+
+// Wake up on the frames the receive task passes on while at least one user asks for it
+void powerSetCanWake(uint32_t user, bool enable)
+{
+	canWakeUsers = enable ? canWakeUsers | user : canWakeUsers & ~user;
+}
+
+/*
+ * Block the loop task until Bluetooth data, CAN activity (if armed) or the timeout
+ * wakes it up. The CPU runs at the idle clock while blocked, unless fullClock is
+ * set for latency critical paths, and the idle task clock-gates it in between
+ * interrupts. Returns at full clock.
+ */
+WakeReason powerIdleWait(uint32_t timeoutMs, bool fullClock = false)
+{
+	int64_t start = esp_timer_get_time();
+
+	if (!fullClock)
+		powerIdleSpeed();
+	bool woken = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeoutMs)) != 0;
+	powerFullSpeed();
+
+	if (!woken)
+	{
+		wakeStats.count[WAKE_TIMER]++;
+		return WAKE_TIMER;
+	}
+
+	taskENTER_CRITICAL(&wakeEventMux);
+	WakeReason reason = wakeEventReason;
+	int64_t event = wakeEventUs;
+	taskEXIT_CRITICAL(&wakeEventMux);
+
+	// Events from before the wait only left a stale notification behind
+	if (event >= start)
+	{
+		long long latency = esp_timer_get_time() - event;
+		wakeStats.measured++;
+		wakeStats.latencySumUs += latency;
+		if (latency > wakeStats.latencyMaxUs)
+			wakeStats.latencyMaxUs = latency;
+	}
+
+	wakeStats.count[reason]++;
+	return reason;
+}
+
+void printPowerStats()
+{
+	BTSerial.printf("Power management:" _NL
+					" cpu frequency ...........: %d MHz (idle %d MHz)" _NL
+					" wakeups bt/can/timer ....: %u / %u / %u" _NL
+					" wake latency mean .......: %lld us" _NL
+					" wake latency max ........: %lld us" _NL _NL,
+					(int)getCpuFrequencyMhz(), CPU_FREQ_IDLE_MHZ,
+					wakeStats.count[WAKE_BLUETOOTH], wakeStats.count[WAKE_CAN], wakeStats.count[WAKE_TIMER],
+					wakeStats.measured ? wakeStats.latencySumUs / wakeStats.measured : 0LL,
+					wakeStats.latencyMaxUs);
+}
+
 String node_name;
 
 const char *getNodeName(uint32_t id)
@@ -111,153 +253,1355 @@ const char *getNodeName(uint32_t id)
 	return node_name.c_str();
 }
 
-void setValue(uint8_t receipient, uint8_t reg, uint8_t value)
+/*
+ * Register shadow: the last value seen of each console, battery and motor
+ * register. It is fed by our own reads and writes and by decoding the traffic of
+ * other masters on the bus, e.g. the console polling the battery during a ride,
+ * so the live system state can be followed without sending a single request.
+ */
+#define SHADOW_NODES 3
+#define SNIFF_REPLY_MS 100 // a reply has to follow its request within this time
+#define SNIFF_PENDING 8	   // outstanding requests of other masters that are tracked
+#define RX_QUEUE_LEN 64	   // received frames waiting for the loop task
+
+struct RegisterInfo
+{
+	uint8_t node;
+	uint8_t reg; // most significant byte of multi-byte values, the others follow it
+	uint8_t bytes;
+	const char *name;
+	float offset;
+	float scale;
+	const char *unit;
+};
+
+#define REGISTER(node, reg, bytes, offset, scale, unit) {node, reg, bytes, #reg, offset, scale, unit}
+
+const RegisterInfo registerInfo[] = {
+	REGISTER(CONSOLE, CONSOLE_REF_SW, 1, 0, 1, ""),
+	REGISTER(CONSOLE, CONSOLE_REF_HW, 1, 0, 1, ""),
+	REGISTER(CONSOLE, CONSOLE_SN_PN_HI, 2, 0, 1, ""),
+	REGISTER(CONSOLE, CONSOLE_SN_ITEM_HI, 2, 0, 1, ""),
+	REGISTER(CONSOLE, CONSOLE_GEOMETRY_CIRC_HI, 2, 0, 1, "mm"),
+	REGISTER(CONSOLE, CONSOLE_ASSIST_MAXSPEEDFLAG, 1, 0, 1, ""),
+	REGISTER(CONSOLE, CONSOLE_ASSIST_MAXSPEED_HI, 2, 0, 0.1, "Km/h"),
+	REGISTER(CONSOLE, CONSOLE_ASSIST_MINSPEEDFLAG, 1, 0, 1, ""),
+	REGISTER(CONSOLE, CONSOLE_ASSIST_MINSPEED, 1, 0, 0.1, "Km/h"),
+	REGISTER(CONSOLE, CONSOLE_ASSIST_INITLEVEL, 1, 0, 1, ""),
+	REGISTER(CONSOLE, CONSOLE_ASSIST_MOUNTAINCAP, 1, 0, 1.5625, "%"),
+	REGISTER(CONSOLE, CONSOLE_STATUS_SLAVE, 1, 0, 1, ""),
+	REGISTER(CONSOLE, CONSOLE_THROTTLE_MAXSPEEDFLAG, 1, 0, 1, ""),
+	REGISTER(CONSOLE, CONSOLE_THROTTLE_MAXSPEED_HI, 2, 0, 0.1, "Km/h"),
+	REGISTER(CONSOLE, CONSOLE_STATS_ODO_1, 4, 0, 0.1, "Km"),
+
+	REGISTER(BATTERY, BATTERY_REF_SW, 1, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_REF_HW, 1, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_SN_PN_HI, 2, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_SN_ITEM_HI, 2, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_CONFIG_SHUTDOWN, 1, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_CONFIG_PACKSERIAL, 1, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_CONFIG_PACKPARALLEL, 1, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_CONFIG_CELLCAPACITY_HI, 2, 0, 0.001, "Ah"),
+	REGISTER(BATTERY, BATTERY_STATUS_VBATT_HI, 2, 0, 0.001, "V"),
+	REGISTER(BATTERY, BATTERY_STATUS_LEVEL, 1, 0, 6.6667, "%"),
+	REGISTER(BATTERY, BATTERY_STATUS_PACKTEMPERATURE1, 1, 0, 1, _DEGREE_SIGN "C"),
+	REGISTER(BATTERY, BATTERY_CELLMON_CHANNELADDR, 1, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_CELLMON_CHANNELDATA_HI, 2, 0, 0.001, "V"),
+	REGISTER(BATTERY, BATTERY_CELLMON_BALANCERENABLED, 1, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_STATS_LMD_HI, 2, 0, 0.002142, "Ah"),
+	REGISTER(BATTERY, BATTERY_STATS_RESET_HI, 2, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_STATS_CHARGETIMEWORST_HI, 2, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_STATS_CHARGETIMEMEAN_HI, 2, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_STATS_BATTCYCLES_HI, 2, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_STATS_BATTFULLCYCLES_HI, 2, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_STATS_POWERCYCLES_HI, 2, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_STATS_VBATTMAX, 1, 20.8333, 0.416667, "V"),
+	REGISTER(BATTERY, BATTERY_STATS_VBATTMIN, 1, 20.8333, 0.416667, "V"),
+	REGISTER(BATTERY, BATTERY_STATS_VBATTMEAN, 1, 20.8333, 0.416667, "V"),
+	REGISTER(BATTERY, BATTERY_STATS_TBATTMAX, 1, 0, 1, _DEGREE_SIGN "C"),
+	REGISTER(BATTERY, BATTERY_STATS_TBATTMIN, 1, 0, 1, _DEGREE_SIGN "C"),
+	REGISTER(BATTERY, BATTERY_STSTS_GGJSRCALIB, 1, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_STSTS_VCTRLSHORTS, 1, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_STATS_CHARGELEVEL_ADDR, 1, 0, 1, ""),
+	REGISTER(BATTERY, BATTERY_STATS_CHARGELEVEL_HI, 2, 0, 1, ""),
+
+	REGISTER(MOTOR, MOTOR_REF_SW, 1, 0, 1, ""),
+	REGISTER(MOTOR, MOTOR_REF_HW, 1, 0, 1, ""),
+	REGISTER(MOTOR, MOTOR_GEOMETRY_CIRC_HI, 2, 0, 1, "mm"),
+	REGISTER(MOTOR, MOTOR_SN_PN_HI, 2, 0, 1, ""),
+	REGISTER(MOTOR, MOTOR_SN_ITEM_HI, 2, 0, 1, ""),
+	REGISTER(MOTOR, MOTOR_PROTECT_UNLOCK, 1, 0, 1, ""),
+	REGISTER(MOTOR, MOTOR_ASSIST_MAXSPEED, 1, 0, 1, "Km/h"),
+	REGISTER(MOTOR, MOTOR_REALTIME_TEMP, 1, 0, 1, _DEGREE_SIGN "C"),
+};
+
+#define REGISTER_INFOS (int)(sizeof(registerInfo) / sizeof(registerInfo[0]))
+
+struct SniffRequest
+{
+	uint8_t node; // shadow node index
+	uint8_t reg;
+	uint32_t ms;
+};
+
+struct CanFrame
 {
 	twai_message_t message;
+	uint32_t ms;  // millis() when the frame was received
+	int8_t node;  // shadow node whose register the frame carried, -1 for none
+	bool changed; // the frame changed the shadow value
+};
+
+const uint8_t shadowNodeId[SHADOW_NODES] = {CONSOLE, BATTERY, MOTOR};
+const char *shadowNodeName[SHADOW_NODES] = {"console", "battery", "motor"};
+
+struct
+{
+	uint8_t value[SHADOW_NODES][256];
+	bool valid[SHADOW_NODES][256];
+	uint32_t seenMs[SHADOW_NODES][256];
+	uint8_t info[SHADOW_NODES][256]; // index into registerInfo + 1, 0 for unknown registers
+	SniffRequest pending[SNIFF_PENDING]; // oldest first
+	int pendingCount;
+	bool live;
+	unsigned int frames;
+	unsigned int decoded;
+} shadow;
+
+// The receive task updates the shadow while the loop task reads and writes it
+portMUX_TYPE shadowMux = portMUX_INITIALIZER_UNLOCKED;
+QueueHandle_t rxQueue;
+unsigned int rxDropped; // frames the loop task did not take in time
+
+int shadowNode(uint32_t id)
+{
+	for (int node = 0; node < SHADOW_NODES; node++)
+		if (shadowNodeId[node] == id)
+			return node;
+
+	return -1;
+}
+
+void shadowInit()
+{
+	for (int i = 0; i < REGISTER_INFOS; i++)
+		for (int b = 0; b < registerInfo[i].bytes; b++)
+			shadow.info[shadowNode(registerInfo[i].node)][registerInfo[i].reg + b] = i + 1;
+}
+
+// Returns true if the value changed, ms is when the value was received
+bool shadowUpdate(uint8_t receipient, uint8_t reg, uint8_t value, uint32_t ms)
+{
+	int node = shadowNode(receipient);
+	if (node < 0)
+		return false;
+
+	taskENTER_CRITICAL(&shadowMux);
+	bool changed = !shadow.valid[node][reg] || shadow.value[node][reg] != value;
+
+	shadow.value[node][reg] = value;
+	shadow.valid[node][reg] = true;
+	shadow.seenMs[node][reg] = ms;
+	taskEXIT_CRITICAL(&shadowMux);
+
+	return changed;
+}
+
+void printShadowValue(int node, uint8_t reg)
+{
+	int index = shadow.info[node][reg];
+	const RegisterInfo *info = index ? &registerInfo[index - 1] : NULL;
+	uint8_t first = info ? info->reg : reg;
+	int bytes = info ? info->bytes : 1;
+	uint32_t raw = 0;
+	bool valid = true;
+
+	// Copy the bytes in one go, the receive task may update them in between
+	taskENTER_CRITICAL(&shadowMux);
+	for (int b = 0; b < bytes; b++)
+	{
+		valid = valid && shadow.valid[node][first + b];
+		raw = (raw << 8) | shadow.value[node][first + b];
+	}
+	uint32_t seenMs = shadow.seenMs[node][reg];
+	taskEXIT_CRITICAL(&shadowMux);
+
+	if (!info)
+	{
+		BTSerial.printf("%s 0x%02X = %d" _NL, shadowNodeName[node], reg, (int)raw);
+		return;
+	}
+
+	if (!valid)
+		return;
+
+	BTSerial.printf("%s %s = %0.3f %s (%lu s ago)" _NL, shadowNodeName[node], info->name,
+					(raw + info->offset) * info->scale, info->unit,
+					(unsigned long)((millis() - seenMs) / 1000));
+}
+
+void sniffForget(int i)
+{
+	shadow.pendingCount--;
+	memmove(&shadow.pending[i], &shadow.pending[i + 1], (shadow.pendingCount - i) * sizeof(shadow.pending[0]));
+}
+
+void sniffRequest(int node, uint8_t reg, uint32_t ms)
+{
+	if (shadow.pendingCount == SNIFF_PENDING)
+		sniffForget(0);
+
+	shadow.pending[shadow.pendingCount++] = {(uint8_t)node, reg, ms};
+}
+
+/*
+ * Node index of the oldest outstanding request for reg, -1 if there is none.
+ * Nodes answer in order, so like in runPipeline the oldest request of the same
+ * register is the one being answered, also when several nodes share the address.
+ */
+int sniffReply(uint8_t reg, uint32_t ms)
+{
+	// Requests are kept in the order they were seen, expired ones are in front
+	while (shadow.pendingCount && ms - shadow.pending[0].ms > SNIFF_REPLY_MS)
+		sniffForget(0);
+
+	for (int i = 0; i < shadow.pendingCount; i++)
+	{
+		if (shadow.pending[i].reg == reg)
+		{
+			int node = shadow.pending[i].node;
+			sniffForget(i);
+			return node;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Decode a frame sent by another master. A reply only names the requester and
+ * the register, not the node that answered it, so requests are queued with
+ * their node until the reply shows up. Writes go straight into the shadow.
+ * Sets the node whose register was updated, -1 if the frame carried no value.
+ * Only called from the receive task.
+ */
+void sniffFrame(CanFrame &frame)
+{
+	const twai_message_t &message = frame.message;
+	int node = shadowNode(message.identifier);
+	uint8_t reg = message.data[1];
+
+	frame.node = -1;
+	frame.changed = false;
+	shadow.frames++;
+
+	if (node >= 0 && message.data_length_code == 2)
+	{
+		sniffRequest(node, reg, frame.ms);
+		return;
+	}
+
+	if (message.data_length_code != 4)
+		return;
+
+	// Replies to BIB are our own, a late one would be taken for another master's
+	if (node < 0)
+	{
+		if (message.identifier != CONSOLE_STANDARD_MODE)
+			return;
+		node = sniffReply(reg, frame.ms);
+		if (node < 0)
+			return;
+	}
+
+	shadow.decoded++;
+	frame.node = node;
+	frame.changed = shadowUpdate(shadowNodeId[node], reg, message.data[3], frame.ms);
+}
+
+/*
+ * Takes every frame off the driver queue as it arrives and decodes it into the
+ * shadow, so the shadow follows the whole bus also while the loop task sleeps or
+ * talks to the client. Only the frames the loop task needs are passed on to it:
+ * replies to our own requests, all frames during a capture and changed values
+ * during live decoding.
+ */
+void canRxTask(void *arg)
+{
+	CanFrame frame;
+
+	for (;;)
+	{
+		if (twai_receive(&frame.message, portMAX_DELAY) != ESP_OK)
+		{
+			vTaskDelay(pdMS_TO_TICKS(IDLE_WAKE_MS));
+			continue;
+		}
+		frame.ms = millis();
+		sniffFrame(frame);
+
+		uint32_t users = canWakeUsers;
+		if (frame.message.identifier != BIB && !(users & CAN_WAKE_CAPTURE) && !(frame.changed && (users & CAN_WAKE_LIVE)))
+			continue;
+
+		if (xQueueSend(rxQueue, &frame, 0) != pdTRUE)
+			rxDropped++;
+		else if (users)
+			notifyWake(WAKE_CAN);
+	}
+}
+
+// Print a value the receive task decoded while live decoding is on
+void sniffShow(const CanFrame &frame)
+{
+	if (frame.changed && shadow.live)
+		printShadowValue(frame.node, frame.message.data[1]);
+}
+
+// Show the frames that were passed on while nobody was reading the bus
+void rxDrain()
+{
+	CanFrame frame;
+
+	while (xQueueReceive(rxQueue, &frame, 0) == pdTRUE)
+		sniffShow(frame);
+}
+
+void sniffToggleLive()
+{
+	shadow.live = !shadow.live;
+	// Wake up on changed values only while someone is watching
+	powerSetCanWake(CAN_WAKE_LIVE, shadow.live);
+	BTSerial.printf("Live decoding %s" _NL, shadow.live ? "started. Send d to stop." : "stopped");
+}
+
+void printShadow()
+{
+	twai_status_info_t status;
+	unsigned int missed = 0;
+
+	// Frames the driver had no room for never reached the shadow
+	if (twai_get_status_info(&status) == ESP_OK)
+		missed = status.rx_missed_count + status.rx_overrun_count;
+
+	BTSerial.printf("Register shadow, %u frames seen, %u decoded, %u missed, %u not shown:" _NL,
+					shadow.frames, shadow.decoded, missed, rxDropped);
+
+	for (int i = 0; i < REGISTER_INFOS; i++)
+	{
+		int node = shadowNode(registerInfo[i].node);
+		if (shadow.valid[node][registerInfo[i].reg + registerInfo[i].bytes - 1])
+			printShadowValue(node, registerInfo[i].reg);
+	}
+
+	BTSerial.println();
+}
+
+/*
+ * Transmit statistics. Commands run one at a time on the loop task and go
+ * straight to the driver queue in the order they are sent, so these only show
+ * how deep that queue gets and how long a transmit has to wait for room in it.
+ */
+struct
+{
+	unsigned int sent;
+	unsigned int failed;
+	unsigned int queueHighWater;
+	long long waitSumUs;
+	long long waitMaxUs;
+} txStats;
+
+void printTxStats()
+{
+	twai_status_info_t status;
+
+	BTSerial.printf("CAN transmit:" _NL
+					" sent %u failed %u, driver queue max %u, wait mean/max %lld/%lld us" _NL,
+					txStats.sent, txStats.failed, txStats.queueHighWater,
+					txStats.sent ? txStats.waitSumUs / txStats.sent : 0LL, txStats.waitMaxUs);
+
+	if (twai_get_status_info(&status) == ESP_OK)
+		BTSerial.printf(" driver queue %d, tx failed %d, arbitration lost %d, bus errors %d" _NL,
+						(int)status.msgs_to_tx, (int)status.tx_failed_count, (int)status.arb_lost_count, (int)status.bus_error_count);
+
+	BTSerial.println();
+}
+
+bool transmitRequest(uint8_t receipient, uint8_t reg, uint8_t value, bool write, bool quiet = false)
+{
+	twai_message_t message;
+	twai_status_info_t status;
 
 	message.identifier = receipient;
-	message.data_length_code = 4;
+	message.data_length_code = write ? 4 : 2;
 	message.data[0] = 0x00;
 	message.data[1] = reg;
 	message.data[2] = 0x00;
 	message.data[3] = value;
 
-	if (twai_transmit(&message, pdMS_TO_TICKS(1000)) != ESP_OK)
+	if (twai_get_status_info(&status) == ESP_OK && status.msgs_to_tx + 1 > txStats.queueHighWater)
+		txStats.queueHighWater = status.msgs_to_tx + 1;
+
+	int64_t start = esp_timer_get_time();
+	if (twai_transmit(&message, pdMS_TO_TICKS(TX_TIMEOUT_MS)) != ESP_OK)
+	{
+		txStats.failed++;
+		if (quiet)
+			return false;
+		BTSerial.printf("Failed to queue message for transmission\n");
+		BTSerial.printf("ERROR: Failed to send the packet to %s" _NL, getNodeName(receipient));
+		return false;
+	}
+
+	long long wait = esp_timer_get_time() - start;
+	txStats.waitSumUs += wait;
+	if (wait > txStats.waitMaxUs)
+		txStats.waitMaxUs = wait;
+	txStats.sent++;
+
+	if (write)
+		shadowUpdate(receipient, reg, value, millis());
+
+	return true;
+}
+
+void setValue(uint8_t receipient, uint8_t reg, uint8_t value)
+{
+	transmitRequest(receipient, reg, value, true);
+}
+
+unsigned int busTimeouts; // reads that got no reply, lets callers spot a failed read
+
+struct BusOp
+{
+	uint8_t reg;
+	uint8_t value; // value to write, or the value read
+	bool write;
+	bool done;
+};
+
+/*
+ * Send a sequence of register reads and writes to one node without waiting for
+ * each reply before sending the next request. Up to PIPELINE_DEPTH reads are kept
+ * outstanding. The node answers in order, so a reply belongs to the oldest
+ * outstanding read of the same register. Returns false if no reply arrives for
+ * timeoutMs, the reads that did not complete are left at 0. A quiet pipeline,
+ * as used by the monitor, prints no errors and waits at most MONITOR_TIMEOUT_MS
+ * for a reply, so a command typed during a sample is not held up for long.
+ */
+bool runPipeline(uint8_t receipient, BusOp *ops, int count, bool quiet = false, uint32_t timeoutMs = TIMEOUT_VALUE * TIMEOUT_MS)
+{
+	CanFrame frame;
+	const twai_message_t &message = frame.message;
+	int next = 0, oldest = 0, outstanding = 0;
+	uint32_t lastReplyMs = millis();
+
+	if (quiet && timeoutMs > MONITOR_TIMEOUT_MS)
+		timeoutMs = MONITOR_TIMEOUT_MS;
+
+	// Late replies to an earlier pipeline must not be taken for ours
+	rxDrain();
+
+	for (int i = 0; i < count; i++)
+	{
+		ops[i].done = ops[i].write;
+		if (!ops[i].write)
+			ops[i].value = 0;
+	}
+
+	for (;;)
+	{
+		while (next < count && outstanding < PIPELINE_DEPTH)
+		{
+			if (!transmitRequest(receipient, ops[next].reg, ops[next].value, ops[next].write, quiet))
+				return false;
+			if (!ops[next].write)
+				outstanding++;
+			next++;
+		}
+
+		while (oldest < count && ops[oldest].done)
+			oldest++;
+		if (oldest == count)
+			return true;
+
+		// A deadline rather than a count of receives, frames of other masters do not shorten it
+		if (millis() - lastReplyMs >= timeoutMs)
+		{
+			busTimeouts++;
+			if (quiet)
+				return false;
+			BTSerial.printf("ERROR: no response from node %s to %s" _NL, getNodeName(receipient), getNodeName(BIB));
+			return false;
+		}
+
+		if (xQueueReceive(rxQueue, &frame, pdMS_TO_TICKS(TIMEOUT_MS)) != pdTRUE)
+		{
+			if (!quiet)
+				BTSerial.printf(".");
+			continue;
+		}
+
+		bool matched = false;
+
+		if (message.identifier == BIB && message.data_length_code == 4)
+		{
+			for (int i = oldest; i < next && !matched; i++)
+			{
+				if (!ops[i].done && ops[i].reg == message.data[1])
+				{
+					ops[i].value = message.data[3];
+					ops[i].done = true;
+					outstanding--;
+					lastReplyMs = millis();
+					shadowUpdate(receipient, ops[i].reg, ops[i].value, frame.ms);
+					matched = true;
+				}
+			}
+		}
+
+		if (!matched)
+			sniffShow(frame);
+	}
+}
+
+uint8_t getValue(uint8_t receipient, uint8_t reg)
+{
+	BusOp op = {reg, 0, false, false};
+
+	runPipeline(receipient, &op, 1);
+
+	return op.value;
+}
+
+// Compare the upper bytes of a snapshot read with their re-reads
+bool snapshotTorn(const BusOp *ops, int count)
+{
+	for (int i = 0; i < count - 1; i++)
+		if (ops[i].value != ops[count + i].value)
+			return true;
+
+	return false;
+}
+
+/*
+ * Read a value spread over up to four registers, most significant byte first.
+ * The upper bytes are read a second time at the end of the same pipeline, so a
+ * carry out of a lower byte between the reads shows up as a changed upper byte
+ * and only then the value is read again. Costs one round-trip when nothing
+ * changed.
+ */
+bool readSnapshot(uint8_t receipient, const uint8_t *regs, int count, uint32_t *value, bool quiet)
+{
+	BusOp ops[SNAPSHOT_MAX_BYTES * 2 - 1];
+	int total = count * 2 - 1;
+
+	for (int attempt = 0; attempt < SNAPSHOT_RETRIES; attempt++)
+	{
+		// A quiet poll does not retry once a command is waiting
+		if (quiet && attempt && BTSerial.available())
+			return false;
+
+		for (int i = 0; i < total; i++)
+			ops[i] = {regs[i % count], 0, false, false};
+
+		if (!runPipeline(receipient, ops, total, quiet))
+			return false;
+
+		*value = 0;
+		for (int i = 0; i < count; i++)
+			*value = (*value << 8) | ops[i].value;
+
+		if (!snapshotTorn(ops, count))
+			return true;
+	}
+
+	if (!quiet)
+		BTSerial.printf("ERROR: value of node %s kept changing while reading it" _NL, getNodeName(receipient));
+	return false;
+}
+
+uint32_t getSnapshot(uint8_t receipient, const uint8_t *regs, int count)
+{
+	uint32_t value;
+
+	return readSnapshot(receipient, regs, count, &value, false) ? value : 0;
+}
+
+uint16_t getValue16(uint8_t receipient, uint8_t regHi, uint8_t regLo)
+{
+	const uint8_t regs[] = {regHi, regLo};
+
+	return getSnapshot(receipient, regs, 2);
+}
+
+uint32_t getValue32(uint8_t receipient, uint8_t reg1, uint8_t reg2, uint8_t reg3, uint8_t reg4)
+{
+	const uint8_t regs[] = {reg1, reg2, reg3, reg4};
+
+	return getSnapshot(receipient, regs, 4);
+}
+
+/*
+ * Plain HI/LO reads for 16-bit values that do not change while connected, i.e.
+ * configuration and lifetime counters. Both requests go out in one pipeline and
+ * there is no tear check, live values are read with getValue16 instead.
+ */
+int pipeWord(BusOp *ops, uint8_t regHi, uint8_t regLo)
+{
+	ops[0] = {regHi, 0, false, false};
+	ops[1] = {regLo, 0, false, false};
+
+	return 2;
+}
+
+uint16_t pipeWordValue(const BusOp *ops)
+{
+	return (ops[0].value << 8) | ops[1].value;
+}
+
+uint16_t getStaticValue16(uint8_t receipient, uint8_t regHi, uint8_t regLo)
+{
+	BusOp ops[2];
+
+	runPipeline(receipient, ops, pipeWord(ops, regHi, regLo));
+
+	return pipeWordValue(ops);
+}
+
+/*
+ * Read the voltages of the first cells channels in one pipeline, each one as a
+ * snapshot of the channel data registers. Only torn readings are read again.
+ * Cells without a consistent reading are set to CELL_INVALID and the function
+ * returns false.
+ */
+bool readCellVoltages(int cells, uint16_t *millivolts, bool quiet = false)
+{
+	BusOp ops[MAX_CELLS * 4];
+	int channels[MAX_CELLS];
+	int pending = 0;
+
+	for (int cell = 0; cell < cells; cell++)
+	{
+		millivolts[cell] = CELL_INVALID;
+		channels[pending++] = cell + 1;
+	}
+
+	for (int attempt = 0; attempt < SNAPSHOT_RETRIES && pending; attempt++)
+	{
+		if (quiet && attempt && BTSerial.available())
+			return false;
+
+		for (int i = 0; i < pending; i++)
+		{
+			BusOp *op = &ops[i * 4];
+			op[0] = {BATTERY_CELLMON_CHANNELADDR, (uint8_t)(0x80 + channels[i]), true, false};
+			op[1] = {BATTERY_CELLMON_CHANNELDATA_HI, 0, false, false};
+			op[2] = {BATTERY_CELLMON_CHANNELDATA_LO, 0, false, false};
+			op[3] = op[1];
+		}
+
+		if (!runPipeline(BATTERY, ops, pending * 4, quiet))
+			return false;
+
+		int torn = 0;
+		for (int i = 0; i < pending; i++)
+		{
+			BusOp *op = &ops[i * 4];
+			if (snapshotTorn(op + 1, 2))
+				channels[torn++] = channels[i];
+			else
+				millivolts[channels[i] - 1] = (op[1].value << 8) | op[2].value;
+		}
+		pending = torn;
+	}
+
+	return pending == 0;
+}
+
+void setSpeedLimit(double speed)
+{
+	int limit = (speed != 0);
+
+	if (!speed)
+		speed = UNLIMITED_SPEED_VALUE;
+	setValue(CONSOLE, CONSOLE_ASSIST_MAXSPEEDFLAG, limit);
+	setValue(CONSOLE, CONSOLE_ASSIST_MAXSPEED_HI, ((int)(speed * 10)) >> 8);
+	setValue(CONSOLE, CONSOLE_ASSIST_MAXSPEED_LO, ((int)(speed * 10)) & 0xff);
+	setValue(MOTOR, MOTOR_PROTECT_UNLOCK, MOTOR_PROTECT_UNLOCK_KEY);
+	setValue(MOTOR, MOTOR_ASSIST_MAXSPEED, (int)speed);
+}
+
+void setWheelCircumference(unsigned short circumference)
+{
+	if (!circumference)
+		return;
+
+	setValue(CONSOLE, CONSOLE_GEOMETRY_CIRC_HI, (int)(circumference >> 8));
+	setValue(CONSOLE, CONSOLE_GEOMETRY_CIRC_LO, (int)(circumference & 0xff));
+	setValue(MOTOR, MOTOR_PROTECT_UNLOCK, MOTOR_PROTECT_UNLOCK_KEY);
+	setValue(MOTOR, MOTOR_GEOMETRY_CIRC_HI, (int)(circumference >> 8));
+	setValue(MOTOR, MOTOR_GEOMETRY_CIRC_LO, (int)(circumference & 0xff));
+}
+
+void setMinSpeedLimit(double speed)
+{
+	char limit = (speed != 0);
+
+	setValue(CONSOLE, CONSOLE_ASSIST_MINSPEEDFLAG, limit);
+	setValue(CONSOLE, CONSOLE_ASSIST_MINSPEED, (int)(speed * 10));
+}
+
+void setThrottleSpeedLimit(double speed)
+{
+	int limit = (speed != 0);
+
+	if (!speed)
+		speed = MAX_THROTTLE_SPEED_VALUE;
+
+	setValue(CONSOLE, CONSOLE_THROTTLE_MAXSPEEDFLAG, limit);
+	setValue(CONSOLE, CONSOLE_THROTTLE_MAXSPEED_HI, ((int)(speed * 10)) >> 8);
+	setValue(CONSOLE, CONSOLE_THROTTLE_MAXSPEED_LO, ((int)(speed * 10)) & 0xff);
+}
+
+// The pack layout does not change, it is read once during discovery
+void printBatteryStats(int packSerial, int packParallel)
+{
+	int channel = 1;
+
+	BTSerial.printf(" balancer enabled ...: %s" _NL _NL, (getValue(BATTERY, BATTERY_CELLMON_BALANCERENABLED) != 0 ? "yes" : "no"));
+
+	uint16_t cellVoltage[MAX_CELLS];
+	readCellVoltages(packSerial, cellVoltage);
+	for (; channel <= packSerial; channel++)
+	{
+		if (cellVoltage[channel - 1] == CELL_INVALID)
+			BTSerial.printf(" voltage cell #%02d ...: n/a" _NL, channel);
+		else
+			BTSerial.printf(" voltage cell #%02d ...: %.3fV" _NL, channel, cellVoltage[channel - 1] * 0.001);
+	}
+
+	for (channel = 0; channel < packParallel; channel++)
+		BTSerial.printf(" temperature pack #%02d: %d" _DEGREE_SIGN "C" _NL, channel + 1,
+						getValue(BATTERY, BATTERY_STATUS_PACKTEMPERATURE1 + channel));
+
+	BTSerial.println();
+}
+
+/*
+ * Read all bins of the charge level histogram in one pipeline. The bins only
+ * change while charging, so a plain HI/LO read needs no tear check.
+ */
+bool readChargeHistogram(uint16_t *bins)
+{
+	BusOp ops[BATTERY_STATS_CHARGELEVEL_BINS * 3];
+
+	for (int bin = 0; bin < BATTERY_STATS_CHARGELEVEL_BINS; bin++)
+	{
+		ops[bin * 3] = {BATTERY_STATS_CHARGELEVEL_ADDR, (uint8_t)(bin + 1), true, false};
+		pipeWord(ops + bin * 3 + 1, BATTERY_STATS_CHARGELEVEL_HI, BATTERY_STATS_CHARGELEVEL_LO);
+	}
+
+	if (!runPipeline(BATTERY, ops, BATTERY_STATS_CHARGELEVEL_BINS * 3))
+		return false;
+
+	for (int bin = 0; bin < BATTERY_STATS_CHARGELEVEL_BINS; bin++)
+		bins[bin] = pipeWordValue(ops + bin * 3 + 1);
+
+	return true;
+}
+
+void printChargeStats()
+{
+	uint16_t bins[BATTERY_STATS_CHARGELEVEL_BINS];
+	int totalCharges = 0;
+
+	if (!readChargeHistogram(bins))
+		return;
+
+	for (int bin = 0; bin < BATTERY_STATS_CHARGELEVEL_BINS; bin++)
+	{
+		totalCharges += bins[bin];
+		BTSerial.printf(" charge level @ %03d%% : %04d" _NL, (bin + 1) * 10, bins[bin]);
+	}
+
+	BTSerial.printf(" total # of charges .: %04d" _NL _NL, totalCharges);
+}
+
+double getVoltageValue(unsigned char in, unsigned char reg)
+{
+	return (getValue(BATTERY, reg) + 20.8333) * 0.416667;
+}
+
+/*
+ * Versions of the nodes, read once after connecting. They select a read plan per
+ * node: the print functions are specialized per generation at compile time, so
+ * registers a generation does not have are never requested, and nodes that did
+ * not answer cost no bus time at all. Nodes that did not answer and nodes with a
+ * read that timed out are probed again before the next plan runs.
+ */
+struct NodeCaps
+{
+	bool discovered;
+	uint8_t stale; // bit per shadow node index, answered but missed a read
+	uint8_t consoleHw, consoleSw;
+	uint8_t batteryHw, batterySw;
+	uint8_t motorHw, motorSw;
+	// Immutable registers, read and cached along with the versions
+	uint16_t consolePartNumber, consoleItemNumber;
+	uint16_t batteryPartNumber, batteryItemNumber;
+	uint16_t motorPartNumber, motorItemNumber;
+	uint8_t batteryCells, batteryParallel;
+};
+
+typedef void (*ReadPlan)(const NodeCaps &caps);
+
+NodeCaps caps;
+
+struct
+{
+	ReadPlan console;
+	ReadPlan battery;
+	ReadPlan motor;
+} readPlan;
+
+template <uint8_t Node>
+void printNotResponding(const NodeCaps &caps)
+{
+	const char *name = Node == CONSOLE ? "Console" : Node == BATTERY ? "Battery" : "Motor";
+
+	BTSerial.printf("%s not responding" _NL _NL, name);
+}
+
+template <bool MountainCap>
+void printConsoleSettings(const NodeCaps &caps)
+{
+	int wheelCirc;
+	const char *sl;
+	double speedLimit = 0;
+
+	BTSerial.printf("Console information:" _NL
+					" hardware version ........: %02d" _NL
+					" software version ........: %02d" _NL
+					" assistance level ........: %d" _NL,
+					caps.consoleHw, caps.consoleSw,
+					getValue(CONSOLE, CONSOLE_ASSIST_INITLEVEL));
+
+	BTSerial.printf(" part number .............: %05d" _NL
+					" item number .............: %05d" _NL _NL,
+					caps.consolePartNumber, caps.consoleItemNumber);
+
+	/* ASSIST speed limit */
+	sl = getValue(CONSOLE, CONSOLE_ASSIST_MAXSPEEDFLAG) == 0 ? "no" : "yes";
+	speedLimit = getStaticValue16(CONSOLE, CONSOLE_ASSIST_MAXSPEED_HI, CONSOLE_ASSIST_MAXSPEED_LO) / (double)10;
+	BTSerial.printf(" max limit enabled .......: %s" _NL
+					" speed limit .............: %0.2f Km/h" _NL _NL,
+					sl, speedLimit);
+
+	/* MIN speed limit */
+	sl = getValue(CONSOLE, CONSOLE_ASSIST_MINSPEEDFLAG) == 0 ? "no" : "yes";
+	speedLimit = (getValue(CONSOLE, CONSOLE_ASSIST_MINSPEED)) / (double)10;
+	BTSerial.printf(" min limit enabled .......: %s" _NL
+					" min speed limit .........: %0.2f Km/h" _NL _NL,
+					sl, speedLimit);
+
+	/* THROTTLE speed limit */
+	sl = getValue(CONSOLE, CONSOLE_THROTTLE_MAXSPEEDFLAG) == 0 ? "no" : "yes";
+	speedLimit = getStaticValue16(CONSOLE, CONSOLE_THROTTLE_MAXSPEED_HI, CONSOLE_THROTTLE_MAXSPEED_LO) / (double)10;
+	BTSerial.printf(" throttle limit enabled ..: %s" _NL
+					" throttle speed limit ....: %0.2f Km/h" _NL _NL,
+					sl, speedLimit);
+
+	/* WHEEL CIRCUMFERENCE */
+	wheelCirc = getStaticValue16(CONSOLE, CONSOLE_GEOMETRY_CIRC_HI, CONSOLE_GEOMETRY_CIRC_LO);
+	BTSerial.printf(" wheel circumference .....: %d mm" _NL _NL, wheelCirc);
+
+	if (MountainCap)
+		BTSerial.printf(
+			" mountain cap ............: %0.2f%%" _NL,
+			(getValue(CONSOLE, CONSOLE_ASSIST_MOUNTAINCAP) * 1.5625));
+
+	BTSerial.printf(" odo .....................: %0.2f Km" _NL _NL,
+					getValue32(CONSOLE, CONSOLE_STATS_ODO_1, CONSOLE_STATS_ODO_2, CONSOLE_STATS_ODO_3, CONSOLE_STATS_ODO_4) /
+						(double)10);
+}
+
+template <bool CellMonitor>
+void printBatterySettings(const NodeCaps &caps)
+{
+	BTSerial.printf("Battery information:" _NL
+					" hardware version ........: %02d" _NL
+					" software version ........: %02d" _NL,
+					caps.batteryHw, caps.batterySw);
+
+	BTSerial.printf(" part number .............: %05d" _NL
+					" item number .............: %05d" _NL,
+					caps.batteryPartNumber, caps.batteryItemNumber);
+
+	BTSerial.printf(" voltage .................: %0.2fV" _NL
+					" battery level ...........: %0.2f%%" _NL
+					" maximum voltage .........: %0.2f%%" _NL
+					" minimum voltage .........: %0.2f%%" _NL
+					" mean voltage ............: %0.2f%%" _NL
+					" resets ..................: %0d" _NL
+					" ggjrCalib ...............: %0d" _NL
+					" vctrlShorts .............: %0d" _NL
+					" lmd .....................: %0.2fAh" _NL
+					" cell capacity ...........: %0.2fAh" _NL _NL,
+					getValue16(BATTERY, BATTERY_STATUS_VBATT_HI, BATTERY_STATUS_VBATT_LO) * 0.001,
+					(getValue(BATTERY, BATTERY_STATUS_LEVEL) * 6.6667),
+					getVoltageValue(BATTERY, BATTERY_STATS_VBATTMAX),
+					getVoltageValue(BATTERY, BATTERY_STATS_VBATTMIN),
+					getVoltageValue(BATTERY, BATTERY_STATS_VBATTMEAN),
+					getStaticValue16(BATTERY, BATTERY_STATS_RESET_HI, BATTERY_STATS_RESET_LO),
+					getValue(BATTERY, BATTERY_STSTS_GGJSRCALIB),
+					getValue(BATTERY, BATTERY_STSTS_VCTRLSHORTS),
+					getStaticValue16(BATTERY, BATTERY_STATS_LMD_HI, BATTERY_STATS_LMD_LO) * 0.002142,
+					getStaticValue16(BATTERY, BATTERY_CONFIG_CELLCAPACITY_HI, BATTERY_CONFIG_CELLCAPACITY_LO) * 0.001);
+
+	BTSerial.printf(" charge time worst .......: %0d" _NL
+					" charge time mean ........: %0d" _NL
+					" charge cycles ...........: %0d" _NL
+					" full charge cycles ......: %0d" _NL
+					" power cycles ............: %0d" _NL
+					" battery temp max ........: %0d" _NL
+					" battery temp min ........: %0d" _NL _NL,
+					getStaticValue16(BATTERY, BATTERY_STATS_CHARGETIMEWORST_HI, BATTERY_STATS_CHARGETIMEWORST_LO),
+					getStaticValue16(BATTERY, BATTERY_STATS_CHARGETIMEMEAN_HI, BATTERY_STATS_CHARGETIMEMEAN_LO),
+					getStaticValue16(BATTERY, BATTERY_STATS_BATTCYCLES_HI, BATTERY_STATS_BATTCYCLES_LO),
+					getStaticValue16(BATTERY, BATTERY_STATS_BATTFULLCYCLES_HI, BATTERY_STATS_BATTFULLCYCLES_LO),
+					getStaticValue16(BATTERY, BATTERY_STATS_POWERCYCLES_HI, BATTERY_STATS_POWERCYCLES_LO),
+					getValue(BATTERY, BATTERY_STATS_TBATTMAX),
+					getValue(BATTERY, BATTERY_STATS_TBATTMIN));
+
+	printChargeStats();
+
+	if (CellMonitor)
+		printBatteryStats(caps.batteryCells, caps.batteryParallel);
+	else
+		BTSerial.printf("No battery details supported by battery hardware #%d" _NL _NL, caps.batteryHw);
+}
+
+void printMotorSettings(const NodeCaps &caps)
+{
+	int wheelCirc;
+
+	BTSerial.printf("Motor information:" _NL
+					" hardware version ........: %02d" _NL
+					" software version ........: %02d" _NL
+					" temperature .............: %02d" _DEGREE_SIGN "C" _NL
+					" speed limit .............: %02d Km/h" _NL,
+					caps.motorHw, caps.motorSw,
+					getValue(MOTOR, MOTOR_REALTIME_TEMP),
+					getValue(MOTOR, MOTOR_ASSIST_MAXSPEED));
+
+	wheelCirc = getStaticValue16(MOTOR, MOTOR_GEOMETRY_CIRC_HI, MOTOR_GEOMETRY_CIRC_LO);
+	BTSerial.printf(" wheel circumference .....: %d mm" _NL _NL, wheelCirc);
+
+	BTSerial.printf(" part number .............: %05d" _NL
+					" item number .............: %05d" _NL _NL,
+					caps.motorPartNumber, caps.motorItemNumber);
+}
+
+void selectReadPlans()
+{
+	if (!caps.consoleHw)
+		readPlan.console = printNotResponding<CONSOLE>;
+	else if (caps.consoleSw >= CONSOLE_MOUNTAINCAP_MIN_SW)
+		readPlan.console = printConsoleSettings<true>;
+	else
+		readPlan.console = printConsoleSettings<false>;
+
+	if (!caps.batteryHw)
+		readPlan.battery = printNotResponding<BATTERY>;
+	else if (caps.batteryHw >= BATTERY_CELLMON_MIN_HW)
+		readPlan.battery = printBatterySettings<true>;
+	else
+		readPlan.battery = printBatterySettings<false>;
+
+	if (!caps.motorHw)
+		readPlan.motor = printNotResponding<MOTOR>;
+	else
+		readPlan.motor = printMotorSettings;
+}
+
+#define NODE_BIT(node) (1 << shadowNode(node))
+#define ALL_NODES 0x07
+
+/*
+ * Read the versions and the immutable registers of a node in one pipeline, the
+ * hardware version first. Returns false when any read failed, a node that
+ * answered some of them is marked stale. The caller keeps the caps of the node
+ * at zero then, so no plan is built from a failed read.
+ */
+bool discoverNode(uint8_t node, const uint8_t *regs, BusOp *ops, int count)
+{
+	for (int i = 0; i < count; i++)
+		ops[i] = {regs[i], 0, false, false};
+
+	caps.stale &= ~NODE_BIT(node);
+	if (runPipeline(node, ops, count) && ops[0].value)
+		return true;
+
+	for (int i = 0; i < count; i++)
+		if (ops[i].done)
+			caps.stale |= NODE_BIT(node);
+
+	return false;
+}
+
+void discoverConsole()
+{
+	const uint8_t regs[] = {CONSOLE_REF_HW, CONSOLE_REF_SW, CONSOLE_SN_PN_HI, CONSOLE_SN_PN_LO, CONSOLE_SN_ITEM_HI, CONSOLE_SN_ITEM_LO};
+	BusOp ops[6];
+	bool found = discoverNode(CONSOLE, regs, ops, 6);
+
+	caps.consoleHw = found ? ops[0].value : 0;
+	caps.consoleSw = found ? ops[1].value : 0;
+	caps.consolePartNumber = found ? (ops[2].value << 8) | ops[3].value : 0;
+	caps.consoleItemNumber = found ? (ops[4].value << 8) | ops[5].value : 0;
+}
+
+void discoverBattery()
+{
+	const uint8_t regs[] = {BATTERY_REF_HW, BATTERY_REF_SW, BATTERY_SN_PN_HI, BATTERY_SN_PN_LO, BATTERY_SN_ITEM_HI, BATTERY_SN_ITEM_LO, BATTERY_CONFIG_PACKSERIAL, BATTERY_CONFIG_PACKPARALLEL};
+	BusOp ops[8];
+	bool found = discoverNode(BATTERY, regs, ops, 8);
+
+	caps.batteryHw = found ? ops[0].value : 0;
+	caps.batterySw = found ? ops[1].value : 0;
+	caps.batteryPartNumber = found ? (ops[2].value << 8) | ops[3].value : 0;
+	caps.batteryItemNumber = found ? (ops[4].value << 8) | ops[5].value : 0;
+	caps.batteryCells = (found && ops[6].value <= MAX_CELLS) ? ops[6].value : 0;
+	caps.batteryParallel = (found && ops[7].value <= MAX_PARALLEL) ? ops[7].value : 0;
+}
+
+void discoverMotor()
+{
+	const uint8_t regs[] = {MOTOR_REF_HW, MOTOR_REF_SW, MOTOR_SN_PN_HI, MOTOR_SN_PN_LO, MOTOR_SN_ITEM_HI, MOTOR_SN_ITEM_LO};
+	BusOp ops[6];
+	bool found = discoverNode(MOTOR, regs, ops, 6);
+
+	caps.motorHw = found ? ops[0].value : 0;
+	caps.motorSw = found ? ops[1].value : 0;
+	caps.motorPartNumber = found ? (ops[2].value << 8) | ops[3].value : 0;
+	caps.motorItemNumber = found ? (ops[4].value << 8) | ops[5].value : 0;
+}
+
+void discoverNodes(uint8_t nodes = ALL_NODES)
+{
+	if (nodes & NODE_BIT(CONSOLE))
+		discoverConsole();
+	if (nodes & NODE_BIT(BATTERY))
+		discoverBattery();
+	if (nodes & NODE_BIT(MOTOR))
+		discoverMotor();
+
+	caps.discovered = true;
+
+	selectReadPlans();
+}
+
+void sessionSaveCaps();
+
+// Probe again every node that did not answer or missed a read, it may be back by now
+void ensureDiscovered()
+{
+	uint8_t nodes = caps.stale;
+
+	if (!caps.consoleHw)
+		nodes |= NODE_BIT(CONSOLE);
+	if (!caps.batteryHw)
+		nodes |= NODE_BIT(BATTERY);
+	if (!caps.motorHw)
+		nodes |= NODE_BIT(MOTOR);
+
+	if (caps.discovered && !nodes)
+		return;
+
+	discoverNodes(caps.discovered ? nodes : ALL_NODES);
+	sessionSaveCaps();
+}
+
+// Run the plan of a node, a read that timed out marks the node for a new probe
+void runReadPlan(uint8_t node, ReadPlan plan)
+{
+	unsigned int timeouts = busTimeouts;
+
+	plan(caps);
+	if (busTimeouts != timeouts)
+		caps.stale |= NODE_BIT(node);
+}
+
+/*
+ * Ring of the last N samples together with their running sums, so the mean and
+ * the change over any window of up to N samples are answered in O(1).
+ */
+template <int N>
+struct RollingWindow
+{
+	int32_t value[N + 1];
+	uint32_t timeMs[N + 1];
+	int64_t prefix[N + 1]; // sum of all samples up to and including this one
+	uint32_t count;
+	int head;
+
+	void reset()
+	{
+		count = 0;
+		head = 0;
+		prefix[0] = 0;
+	}
+
+	void add(int32_t v, uint32_t ms)
+	{
+		int64_t sum = count ? prefix[head] : 0;
+
+		if (count)
+			head = (head + 1) % (N + 1);
+		value[head] = v;
+		timeMs[head] = ms;
+		prefix[head] = sum + v;
+		count++;
+	}
+
+	int available() const
+	{
+		return count < N ? count : N;
+	}
+
+	int32_t latest() const
 	{
-		BTSerial.printf("Failed to queue message for transmission\n");
-		BTSerial.printf("ERROR: Failed to send the packet to %s" _NL, getNodeName(receipient));
+		return value[head];
 	}
-}
 
-uint8_t getValue(uint8_t receipient, uint8_t reg)
-{
-	twai_message_t message;
+	// Mean of the last k samples
+	int32_t mean(int k) const
+	{
+		k = clamp(k);
+		if (!k)
+			return 0;
 
-	message.identifier = receipient;
-	message.data_length_code = 2;
-	message.data[0] = 0x00;
-	message.data[1] = reg;
+		int64_t before = (int)count > k ? prefix[slot(k)] : 0;
+		return (prefix[head] - before) / k;
+	}
 
-	if (twai_transmit(&message, pdMS_TO_TICKS(1000)) != ESP_OK)
+	// Change from the oldest to the newest of the last k samples
+	int32_t delta(int k) const
 	{
-		BTSerial.printf("Failed to queue message for transmission\n");
-		BTSerial.printf("ERROR: Failed to send the packet to %s" _NL, getNodeName(receipient));
+		k = clamp(k);
+		return k ? value[head] - value[slot(k - 1)] : 0;
 	}
 
-	int retry = TIMEOUT_VALUE;
-
-	// Postfix is used because the loop will end when retry is 0
-	while (retry--)
+	// Time from the oldest to the newest of the last k samples
+	uint32_t spanMs(int k) const
 	{
-		if (twai_receive(&message, pdMS_TO_TICKS(TIMEOUT_MS)) != ESP_OK)
-		{
-			BTSerial.printf(".");
-		}
+		k = clamp(k);
+		return k ? timeMs[head] - timeMs[slot(k - 1)] : 0;
+	}
 
-		if (message.identifier == BIB && message.data_length_code == 4 && message.data[1] == reg)
-		{
-			break;
-		}
+	int clamp(int k) const
+	{
+		return k > available() ? available() : k;
 	}
 
-	if (retry == -1)
+	int slot(int back) const
 	{
-		BTSerial.printf("ERROR: no response from node %s to %s" _NL, getNodeName(receipient), getNodeName(BIB));
-		return 0;
+		return (head - back + N + 1) % (N + 1);
 	}
+};
 
-	return message.data[3];
+struct MetricsSample
+{
+	uint32_t timeMs;
+	int32_t batteryMillivolts;
+	int32_t motorTemp;		  // °C
+	int32_t cellMinMillivolts;
+	int32_t cellMaxMillivolts; // 0 when the cells are not monitored
+};
+
+/*
+ * Derived metrics, updated incrementally with integer math for every sample of
+ * the monitor. The windowed ones can be asked for over any of the last
+ * METRICS_WINDOW samples. Power, energy and internal resistance need the battery
+ * current, which has no known register in registers.h, so they are left out.
+ */
+struct
+{
+	uint32_t samples;
+	MetricsSample last;
+	uint32_t sohPermille;
+	RollingWindow<METRICS_WINDOW> imbalance;  // mV
+	RollingWindow<METRICS_WINDOW> motorTemp; // °C
+} metrics;
+
+void metricsReset(uint32_t lmd, uint32_t cellCapacity)
+{
+	metrics.samples = 0;
+	// lmd counts 2.142 mAh, the cell capacity 1 mAh
+	metrics.sohPermille = cellCapacity ? lmd * 2142 / cellCapacity : 0;
+	metrics.imbalance.reset();
+	metrics.motorTemp.reset();
 }
 
-void setSpeedLimit(double speed)
+void metricsUpdate(const MetricsSample &sample)
 {
-	int limit = (speed != 0);
+	if (sample.cellMaxMillivolts)
+		metrics.imbalance.add(sample.cellMaxMillivolts - sample.cellMinMillivolts, sample.timeMs);
 
-	if (!speed)
-		speed = UNLIMITED_SPEED_VALUE;
-	setValue(CONSOLE, CONSOLE_ASSIST_MAXSPEEDFLAG, limit);
-	setValue(CONSOLE, CONSOLE_ASSIST_MAXSPEED_HI, ((int)(speed * 10)) >> 8);
-	setValue(CONSOLE, CONSOLE_ASSIST_MAXSPEED_LO, ((int)(speed * 10)) & 0xff);
-	setValue(MOTOR, MOTOR_PROTECT_UNLOCK, MOTOR_PROTECT_UNLOCK_KEY);
-	setValue(MOTOR, MOTOR_ASSIST_MAXSPEED, (int)speed);
+	metrics.motorTemp.add(sample.motorTemp, sample.timeMs);
+
+	metrics.last = sample;
+	metrics.samples++;
 }
 
-void setWheelCircumference(unsigned short circumference)
+// Motor temperature rise over the last k samples in 0.1 °C per minute
+int32_t metricsTempRate(int k)
 {
-	if (!circumference)
-		return;
+	uint32_t span = metrics.motorTemp.spanMs(k);
 
-	setValue(CONSOLE, CONSOLE_GEOMETRY_CIRC_HI, (int)(circumference >> 8));
-	setValue(CONSOLE, CONSOLE_GEOMETRY_CIRC_LO, (int)(circumference & 0xff));
-	setValue(MOTOR, MOTOR_PROTECT_UNLOCK, MOTOR_PROTECT_UNLOCK_KEY);
-	setValue(MOTOR, MOTOR_GEOMETRY_CIRC_HI, (int)(circumference >> 8));
-	setValue(MOTOR, MOTOR_GEOMETRY_CIRC_LO, (int)(circumference & 0xff));
+	return span ? (int64_t)metrics.motorTemp.delta(k) * 600000 / span : 0;
 }
 
-void setMinSpeedLimit(double speed)
+// Windowed metrics over the last k samples, or over the default windows when k is 0
+void printMetrics(int k = 0)
 {
-	char limit = (speed != 0);
+	int windows[] = {METRICS_SHORT_WINDOW, METRICS_WINDOW};
+	int count = 2;
 
-	setValue(CONSOLE, CONSOLE_ASSIST_MINSPEEDFLAG, limit);
-	setValue(CONSOLE, CONSOLE_ASSIST_MINSPEED, (int)(speed * 10));
+	if (k)
+	{
+		windows[0] = k;
+		count = 1;
+	}
+
+	BTSerial.printf("Metrics over %u samples:" _NL
+					" voltage .................: %0.2fV" _NL
+					" state of health .........: %0.1f%%" _NL,
+					(unsigned int)metrics.samples,
+					metrics.last.batteryMillivolts * 0.001,
+					metrics.sohPermille * 0.1);
+
+	for (int i = 0; i < count; i++)
+	{
+		k = windows[i];
+
+		BTSerial.printf(" last %02d samples:" _NL, k);
+		if (metrics.imbalance.available())
+			BTSerial.printf("  cell imbalance .........: %d mV (%+d mV)" _NL,
+							(int)metrics.imbalance.mean(k), (int)metrics.imbalance.delta(k));
+		BTSerial.printf("  motor temperature rise .: %+0.1f" _DEGREE_SIGN "C/min" _NL, metricsTempRate(k) * 0.1);
+	}
+
+	BTSerial.println();
 }
 
-void setThrottleSpeedLimit(double speed)
+/*
+ * Streaming sampler feeding the metrics. It runs from loop() in between commands
+ * and tells it how long it may sleep until the next sample is due.
+ */
+struct
 {
-	int limit = (speed != 0);
+	bool active;
+	uint32_t periodMs;
+	uint32_t nextMs;
+	unsigned int skipped;
+	int cells;
+} monitor;
+
+void monitorStart(uint32_t periodMs)
+{
+	ensureDiscovered();
 
-	if (!speed)
-		speed = MAX_THROTTLE_SPEED_VALUE;
+	monitor.cells = caps.batteryHw >= BATTERY_CELLMON_MIN_HW ? caps.batteryCells : 0;
 
-	setValue(CONSOLE, CONSOLE_THROTTLE_MAXSPEEDFLAG, limit);
-	setValue(CONSOLE, CONSOLE_THROTTLE_MAXSPEED_HI, ((int)(speed * 10)) >> 8);
-	setValue(CONSOLE, CONSOLE_THROTTLE_MAXSPEED_LO, ((int)(speed * 10)) & 0xff);
+	if (caps.batteryHw)
+		metricsReset(getStaticValue16(BATTERY, BATTERY_STATS_LMD_HI, BATTERY_STATS_LMD_LO),
+					 getStaticValue16(BATTERY, BATTERY_CONFIG_CELLCAPACITY_HI, BATTERY_CONFIG_CELLCAPACITY_LO));
+	else
+		metricsReset(0, 0);
+
+	monitor.periodMs = periodMs;
+	monitor.nextMs = millis();
+	monitor.skipped = 0;
+	monitor.active = true;
+	BTSerial.printf("Monitoring every %u ms. Send r to stop." _NL, (unsigned int)periodMs);
 }
 
-void printBatteryStats()
+void monitorStop()
 {
-	int channel = 1, packSerial, packParallel;
-
-	BTSerial.printf(" balancer enabled ...: %s" _NL _NL, (getValue(BATTERY, BATTERY_CELLMON_BALANCERENABLED != 0) ? "yes" : "no"));
+	monitor.active = false;
+	BTSerial.printf("Monitor stopped, %u samples skipped" _NL, monitor.skipped);
+	printMetrics();
+}
 
-	packSerial = getValue(BATTERY, BATTERY_CONFIG_PACKSERIAL);
-	packParallel = getValue(BATTERY, BATTERY_CONFIG_PACKPARALLEL);
+void monitorSample()
+{
+	MetricsSample sample;
+	uint16_t cellVoltage[MAX_CELLS];
+	const uint8_t vbatt[] = {BATTERY_STATUS_VBATT_HI, BATTERY_STATUS_VBATT_LO};
+	BusOp temp = {MOTOR_REALTIME_TEMP, 0, false, false};
+	uint32_t millivolts = 0;
+
+	sample.timeMs = millis();
+	sample.cellMinMillivolts = 0;
+	sample.cellMaxMillivolts = 0;
+
+	// Polls are quiet and give way to a waiting command
+	if ((caps.batteryHw && !readSnapshot(BATTERY, vbatt, 2, &millivolts, true)) ||
+		BTSerial.available() ||
+		(caps.motorHw && !runPipeline(MOTOR, &temp, 1, true)) ||
+		BTSerial.available() ||
+		(monitor.cells && !readCellVoltages(monitor.cells, cellVoltage, true)))
+	{
+		monitor.skipped++;
+		return;
+	}
 
-	packSerial = (packSerial > 20) ? 0 : packSerial;
-	packParallel = (packParallel > 20) ? 0 : packParallel;
+	sample.batteryMillivolts = millivolts;
+	sample.motorTemp = temp.value;
 
-	for (; channel <= packSerial; channel++)
+	if (monitor.cells)
 	{
-		setValue(BATTERY, BATTERY_CELLMON_CHANNELADDR, (int)0x80 + channel);
-		BTSerial.printf(" voltage cell #%02d ...: %.3fV" _NL, channel,
-						((getValue(BATTERY, BATTERY_CELLMON_CHANNELDATA_HI) << 8) + getValue(BATTERY, BATTERY_CELLMON_CHANNELDATA_LO)) * 0.001);
+		sample.cellMinMillivolts = sample.cellMaxMillivolts = cellVoltage[0];
+		for (int i = 1; i < monitor.cells; i++)
+		{
+			if (cellVoltage[i] < sample.cellMinMillivolts)
+				sample.cellMinMillivolts = cellVoltage[i];
+			if (cellVoltage[i] > sample.cellMaxMillivolts)
+				sample.cellMaxMillivolts = cellVoltage[i];
+		}
 	}
 
-	for (channel = 0; channel < packParallel; channel++)
-		BTSerial.printf(" temperature pack #%02d: %d" _DEGREE_SIGN "C" _NL, channel + 1,
-						getValue(BATTERY, BATTERY_STATUS_PACKTEMPERATURE1 + channel));
+	metricsUpdate(sample);
 
+	BTSerial.printf("%0.2fV %d" _DEGREE_SIGN "C %+0.1f" _DEGREE_SIGN "C/min %dmV",
+					sample.batteryMillivolts * 0.001, (int)sample.motorTemp,
+					metricsTempRate(METRICS_SHORT_WINDOW) * 0.1,
+					(int)(sample.cellMaxMillivolts - sample.cellMinMillivolts));
 	BTSerial.println();
 }
 
-void printChargeStats()
+// Take a sample when it is due, returns the time until the next one
+uint32_t monitorStep()
 {
-	int channel = 1, totalChagres = 0, c;
+	if (!monitor.active)
+		return IDLE_WAKE_MS;
 
-	for (channel = 1; channel <= 10; channel++)
+	if ((int32_t)(millis() - monitor.nextMs) >= 0)
 	{
-		setValue(BATTERY, 0xf6, channel);
-		c = (getValue(BATTERY, 0xf7) << 8) + getValue(BATTERY, 0xf8);
-		totalChagres += c;
-		BTSerial.printf(" charge level @ %03d%% : %04d" _NL, channel * 10, c);
+		monitorSample();
+		monitor.nextMs += monitor.periodMs;
+		// Do not try to catch up after a long command
+		if ((int32_t)(millis() - monitor.nextMs) >= 0)
+			monitor.nextMs = millis() + monitor.periodMs;
 	}
 
-	BTSerial.printf(" total # of charges .: %04d" _NL _NL, totalChagres);
-}
-
-double getVoltageValue(unsigned char in, unsigned char reg)
-{
-	return (getValue(BATTERY, reg) + 20.8333) * 0.416667;
+	// Signed, a slow sample can leave nextMs already behind
+	int32_t wait = (int32_t)(monitor.nextMs - millis());
+	if (wait < 0)
+		return 0;
+	return (uint32_t)wait > monitor.periodMs ? monitor.periodMs : wait;
 }
 
 void usage(void)
@@ -273,175 +1617,304 @@ void usage(void)
 																																																																																								"p ....................... power off system" _NL
 																																																																																								"n ....................... put the console in slave mode" _NL
 																																																																																								"i ....................... capture and display CAN packets. Send anything to stop." _NL
+																																																																																								"r [period] .............. start/stop the live monitor, sampling every [period] ms" _NL
+																																																																																								"e [samples] ............. print the derived metrics of the live monitor, [samples] = window (1 - " __STR(METRICS_WINDOW) ")" _NL
+																																																																																								"d ....................... start/stop decoding live bus traffic into register values" _NL
+																																																																																								"v ....................... print the register values seen so far" _NL
+																																																																																								"x [b] ................... export the battery statistics as CSV, or binary with b" _NL
+																																																																																								"q ....................... print CAN transmit statistics" _NL
+																																																																																								"w ....................... print power management statistics" _NL
 																																																																																								"h ....................... print this help screen" _NL _NL);
 }
 
 void printSystemSettings()
 {
-	int hwVersion, swVersion, wheelCirc;
-	const char *sl;
-	double speedLimit = 0;
-
 	BTSerial.println();
 	BTSerial.println();
 
-	hwVersion = getValue(CONSOLE, CONSOLE_REF_HW);
+	ensureDiscovered();
 
-	if (hwVersion == 0)
-		BTSerial.printf("Console not responding" _NL _NL);
-	else
+	runReadPlan(CONSOLE, readPlan.console);
+	runReadPlan(BATTERY, readPlan.battery);
+	runReadPlan(MOTOR, readPlan.motor);
+}
+
+/*
+ * Battery statistics export. All values are raw register values so the record
+ * stays the same whatever the scaling of a pack generation. The field order below
+ * defines version BATTERY_STATS_VERSION of the encodings, only append to it.
+ */
+#define STATS_BYTE 0 // lo register of a single byte value
+
+struct StatsField
+{
+	const char *name;
+	uint8_t hi;
+	uint8_t lo;
+};
+
+const StatsField batteryStatsFields[] = {
+	{"hw_version", BATTERY_REF_HW, STATS_BYTE},
+	{"sw_version", BATTERY_REF_SW, STATS_BYTE},
+	{"part_number", BATTERY_SN_PN_HI, BATTERY_SN_PN_LO},
+	{"item_number", BATTERY_SN_ITEM_HI, BATTERY_SN_ITEM_LO},
+	{"resets", BATTERY_STATS_RESET_HI, BATTERY_STATS_RESET_LO},
+	{"charge_time_worst", BATTERY_STATS_CHARGETIMEWORST_HI, BATTERY_STATS_CHARGETIMEWORST_LO},
+	{"charge_time_mean", BATTERY_STATS_CHARGETIMEMEAN_HI, BATTERY_STATS_CHARGETIMEMEAN_LO},
+	{"charge_cycles", BATTERY_STATS_BATTCYCLES_HI, BATTERY_STATS_BATTCYCLES_LO},
+	{"full_charge_cycles", BATTERY_STATS_BATTFULLCYCLES_HI, BATTERY_STATS_BATTFULLCYCLES_LO},
+	{"power_cycles", BATTERY_STATS_POWERCYCLES_HI, BATTERY_STATS_POWERCYCLES_LO},
+	{"vbatt_max", BATTERY_STATS_VBATTMAX, STATS_BYTE},
+	{"vbatt_min", BATTERY_STATS_VBATTMIN, STATS_BYTE},
+	{"vbatt_mean", BATTERY_STATS_VBATTMEAN, STATS_BYTE},
+	{"tbatt_max", BATTERY_STATS_TBATTMAX, STATS_BYTE},
+	{"tbatt_min", BATTERY_STATS_TBATTMIN, STATS_BYTE},
+	{"ggjr_calib", BATTERY_STSTS_GGJSRCALIB, STATS_BYTE},
+	{"vctrl_shorts", BATTERY_STSTS_VCTRLSHORTS, STATS_BYTE},
+	{"lmd", BATTERY_STATS_LMD_HI, BATTERY_STATS_LMD_LO},
+	{"cell_capacity", BATTERY_CONFIG_CELLCAPACITY_HI, BATTERY_CONFIG_CELLCAPACITY_LO},
+};
+
+#define BATTERY_STATS_FIELDS (int)(sizeof(batteryStatsFields) / sizeof(batteryStatsFields[0]))
+#define BATTERY_STATS_VERSION 1
+
+struct BatteryStatsRecord
+{
+	uint16_t value[BATTERY_STATS_FIELDS];
+	uint16_t chargeLevel[BATTERY_STATS_CHARGELEVEL_BINS];
+};
+
+// The statistics are counters that do not move while connected, read as plain HI/LO
+bool readBatteryStats(BatteryStatsRecord *record)
+{
+	BusOp ops[BATTERY_STATS_FIELDS * 2];
+	int count = 0;
+
+	for (int i = 0; i < BATTERY_STATS_FIELDS; i++)
 	{
-		swVersion = getValue(CONSOLE, CONSOLE_REF_SW);
-		BTSerial.printf("Console information:" _NL
-						" hardware version ........: %02d" _NL
-						" software version ........: %02d" _NL
-						" assistance level ........: %d" _NL,
-						hwVersion, swVersion,
-						getValue(CONSOLE, CONSOLE_ASSIST_INITLEVEL));
-
-		BTSerial.printf(" part number .............: %05d" _NL
-						" item number .............: %05d" _NL _NL,
-						((getValue(CONSOLE, CONSOLE_SN_PN_HI) << 8) + getValue(CONSOLE, CONSOLE_SN_PN_LO)),
-						((getValue(CONSOLE, CONSOLE_SN_ITEM_HI) << 8) + getValue(CONSOLE, CONSOLE_SN_ITEM_LO)));
-
-		/* ASSIST speed limit */
-		sl = getValue(CONSOLE, CONSOLE_ASSIST_MAXSPEEDFLAG) == 0 ? "no" : "yes";
-		speedLimit = ((getValue(CONSOLE, CONSOLE_ASSIST_MAXSPEED_HI) << 8) + getValue(CONSOLE, CONSOLE_ASSIST_MAXSPEED_LO)) / (double)10;
-		BTSerial.printf(" max limit enabled .......: %s" _NL
-						" speed limit .............: %0.2f Km/h" _NL _NL,
-						sl, speedLimit);
-
-		/* MIN speed limit */
-		sl = getValue(CONSOLE, CONSOLE_ASSIST_MINSPEEDFLAG) == 0 ? "no" : "yes";
-		speedLimit = (getValue(CONSOLE, CONSOLE_ASSIST_MINSPEED)) / (double)10;
-		BTSerial.printf(" min limit enabled .......: %s" _NL
-						" min speed limit .........: %0.2f Km/h" _NL _NL,
-						sl, speedLimit);
-
-		/* THROTTLE speed limit */
-		sl = getValue(CONSOLE, CONSOLE_THROTTLE_MAXSPEEDFLAG) == 0 ? "no" : "yes";
-		speedLimit = ((getValue(CONSOLE, CONSOLE_THROTTLE_MAXSPEED_HI) << 8) + getValue(CONSOLE, CONSOLE_THROTTLE_MAXSPEED_LO)) / (double)10;
-		BTSerial.printf(" throttle limit enabled ..: %s" _NL
-						" throttle speed limit ....: %0.2f Km/h" _NL _NL,
-						sl, speedLimit);
-
-		/* WHEEL CIRCUMFERENCE */
-		wheelCirc = (getValue(CONSOLE, CONSOLE_GEOMETRY_CIRC_HI) << 8) + getValue(CONSOLE, CONSOLE_GEOMETRY_CIRC_LO);
-		BTSerial.printf(" wheel circumference .....: %d mm" _NL _NL, wheelCirc);
-
-		if (swVersion >= 59)
-			BTSerial.printf(
-				" mountain cap ............: %0.2f%%" _NL,
-				(getValue(CONSOLE, CONSOLE_ASSIST_MOUNTAINCAP) * 1.5625));
-
-		BTSerial.printf(" odo .....................: %0.2f Km" _NL _NL,
-						((getValue(CONSOLE, CONSOLE_STATS_ODO_1) << 24) +
-						 (getValue(CONSOLE, CONSOLE_STATS_ODO_2) << 16) +
-						 (getValue(CONSOLE, CONSOLE_STATS_ODO_3) << 8) +
-						 (getValue(CONSOLE, CONSOLE_STATS_ODO_4))) /
-							(double)10);
-	}
-
-	hwVersion = getValue(BATTERY, BATTERY_REF_HW);
-	if (hwVersion == 0)
-		BTSerial.printf("Battery not responding" _NL _NL);
-	else
+		if (batteryStatsFields[i].lo == STATS_BYTE)
+			ops[count++] = {batteryStatsFields[i].hi, 0, false, false};
+		else
+			count += pipeWord(ops + count, batteryStatsFields[i].hi, batteryStatsFields[i].lo);
+	}
+
+	if (!runPipeline(BATTERY, ops, count))
+		return false;
+
+	count = 0;
+	for (int i = 0; i < BATTERY_STATS_FIELDS; i++)
 	{
-		BTSerial.printf("Battery information:" _NL
-						" hardware version ........: %02d" _NL
-						" software version ........: %02d" _NL,
-						hwVersion, getValue(BATTERY, BATTERY_REF_SW));
-
-		BTSerial.printf(" part number .............: %05d" _NL
-						" item number .............: %05d" _NL,
-						((getValue(BATTERY, BATTERY_SN_PN_HI) << 8) + getValue(BATTERY, BATTERY_SN_PN_LO)),
-						((getValue(BATTERY, BATTERY_SN_ITEM_HI) << 8) + getValue(BATTERY, BATTERY_SN_ITEM_LO)));
-
-		BTSerial.printf(" voltage .................: %0.2fV" _NL
-						" battery level ...........: %0.2f%%" _NL
-						" maximum voltage .........: %0.2f%%" _NL
-						" minimum voltage .........: %0.2f%%" _NL
-						" mean voltage ............: %0.2f%%" _NL
-						" resets ..................: %0d" _NL
-						" ggjrCalib ...............: %0d" _NL
-						" vctrlShorts .............: %0d" _NL
-						" lmd .....................: %0.2fAh" _NL
-						" cell capacity ...........: %0.2fAh" _NL _NL,
-						((getValue(BATTERY, BATTERY_STATUS_VBATT_HI) << 8) + getValue(BATTERY, BATTERY_STATUS_VBATT_LO)) * 0.001,
-						(getValue(BATTERY, BATTERY_STATUS_LEVEL) * 6.6667),
-						getVoltageValue(BATTERY, BATTERY_STATS_VBATTMAX),
-						getVoltageValue(BATTERY, BATTERY_STATS_VBATTMIN),
-						getVoltageValue(BATTERY, BATTERY_STATS_VBATTMEAN),
-						(getValue(BATTERY, BATTERY_STATS_RESET_HI) << 8) + getValue(BATTERY, BATTERY_STATS_RESET_LO),
-						getValue(BATTERY, BATTERY_STSTS_GGJSRCALIB),
-						getValue(BATTERY, BATTERY_STSTS_VCTRLSHORTS),
-						((getValue(BATTERY, BATTERY_STATS_LMD_HI) << 8) + getValue(BATTERY, BATTERY_STATS_LMD_LO)) * 0.002142,
-						((getValue(BATTERY, BATTERY_CONFIG_CELLCAPACITY_HI) << 8) + getValue(BATTERY, BATTERY_CONFIG_CELLCAPACITY_LO)) * 0.001);
-
-		BTSerial.printf(" charge time worst .......: %0d" _NL
-						" charge time mean ........: %0d" _NL
-						" charge cycles ...........: %0d" _NL
-						" full charge cycles ......: %0d" _NL
-						" power cycles ............: %0d" _NL
-						" battery temp max ........: %0d" _NL
-						" battery temp min ........: %0d" _NL _NL,
-						(getValue(BATTERY, BATTERY_STATS_CHARGETIMEWORST_HI) << 8) + getValue(BATTERY, BATTERY_STATS_CHARGETIMEWORST_LO),
-						(getValue(BATTERY, BATTERY_STATS_CHARGETIMEMEAN_HI) << 8) + getValue(BATTERY, BATTERY_STATS_CHARGETIMEMEAN_LO),
-						(getValue(BATTERY, BATTERY_STATS_BATTCYCLES_HI) << 8) + getValue(BATTERY, BATTERY_STATS_BATTCYCLES_LO),
-						(getValue(BATTERY, BATTERY_STATS_BATTFULLCYCLES_HI) << 8) + getValue(BATTERY, BATTERY_STATS_BATTFULLCYCLES_LO),
-						(getValue(BATTERY, BATTERY_STATS_POWERCYCLES_HI) << 8) + getValue(BATTERY, BATTERY_STATS_POWERCYCLES_HI),
-						getValue(BATTERY, BATTERY_STATS_TBATTMAX),
-						getValue(BATTERY, BATTERY_STATS_TBATTMIN));
-
-		printChargeStats();
-
-		if (hwVersion >= 60)
-			printBatteryStats();
+		if (batteryStatsFields[i].lo == STATS_BYTE)
+			record->value[i] = ops[count++].value;
 		else
-			BTSerial.printf("No battery details supported by battery hardware #%d" _NL _NL, hwVersion);
+		{
+			record->value[i] = pipeWordValue(ops + count);
+			count += 2;
+		}
 	}
 
-	hwVersion = getValue(MOTOR, MOTOR_REF_HW);
-	if (hwVersion == 0)
-		BTSerial.printf("Motor not responding" _NL _NL);
-	else
+	return readChargeHistogram(record->chargeLevel);
+}
+
+void exportBatteryStatsCsv(const BatteryStatsRecord &record)
+{
+	BTSerial.printf("version");
+	for (int i = 0; i < BATTERY_STATS_FIELDS; i++)
+		BTSerial.printf(",%s", batteryStatsFields[i].name);
+	for (int bin = 1; bin <= BATTERY_STATS_CHARGELEVEL_BINS; bin++)
+		BTSerial.printf(",charge_level_%d", bin * 10);
+	BTSerial.printf(_NL);
+
+	BTSerial.printf("%d", BATTERY_STATS_VERSION);
+	for (int i = 0; i < BATTERY_STATS_FIELDS; i++)
+		BTSerial.printf(",%u", record.value[i]);
+	for (int bin = 0; bin < BATTERY_STATS_CHARGELEVEL_BINS; bin++)
+		BTSerial.printf(",%u", record.chargeLevel[bin]);
+	BTSerial.printf(_NL);
+}
+
+uint16_t crc16(const uint8_t *data, int length)
+{
+	uint16_t crc = 0xffff;
+
+	while (length--)
+	{
+		crc ^= *data++ << 8;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+
+	return crc;
+}
+
+/*
+ * Binary record: "BXS", version, field count, bin count, the fields and bins as
+ * little endian 16-bit values, then a CRC-16/CCITT over all preceding bytes.
+ */
+void exportBatteryStatsBinary(const BatteryStatsRecord &record)
+{
+	uint8_t buffer[6 + (BATTERY_STATS_FIELDS + BATTERY_STATS_CHARGELEVEL_BINS) * 2 + 2];
+	int length = 0;
+
+	buffer[length++] = 'B';
+	buffer[length++] = 'X';
+	buffer[length++] = 'S';
+	buffer[length++] = BATTERY_STATS_VERSION;
+	buffer[length++] = BATTERY_STATS_FIELDS;
+	buffer[length++] = BATTERY_STATS_CHARGELEVEL_BINS;
+
+	for (int i = 0; i < BATTERY_STATS_FIELDS + BATTERY_STATS_CHARGELEVEL_BINS; i++)
+	{
+		uint16_t value = i < BATTERY_STATS_FIELDS ? record.value[i] : record.chargeLevel[i - BATTERY_STATS_FIELDS];
+		buffer[length++] = value & 0xff;
+		buffer[length++] = value >> 8;
+	}
+
+	uint16_t crc = crc16(buffer, length);
+	buffer[length++] = crc & 0xff;
+	buffer[length++] = crc >> 8;
+
+	BTSerial.write(buffer, length);
+}
+
+void exportBatteryStats(bool binary)
+{
+	BatteryStatsRecord record;
+
+	ensureDiscovered();
+	if (!caps.batteryHw)
 	{
-		BTSerial.printf("Motor information:" _NL
-						" hardware version ........: %02d" _NL
-						" software version ........: %02d" _NL
-						" temperature .............: %02d" _DEGREE_SIGN "C" _NL
-						" speed limit .............: %02d Km/h" _NL,
-						hwVersion, getValue(MOTOR, MOTOR_REF_SW),
-						getValue(MOTOR, MOTOR_REALTIME_TEMP),
-						getValue(MOTOR, MOTOR_ASSIST_MAXSPEED));
+		BTSerial.printf("Battery not responding" _NL _NL);
+		return;
+	}
+
+	if (!readBatteryStats(&record))
+		return;
+
+	if (binary)
+		exportBatteryStatsBinary(record);
+	else
+		exportBatteryStatsCsv(record);
+}
+
+/*
+ * Session state that survives resets. It is kept in RTC memory, which outlives
+ * software resets, panics and watchdog resets, and in NVS for when the power was
+ * lost. NVS is only written when the state changes. Bump SESSION_MAGIC whenever
+ * the layout of Session or NodeCaps changes.
+ */
+#define SESSION_MAGIC 0x42584603
+#define PROBE_TIMEOUT_MS 50 // a console in slave mode answers within a few ms
+
+struct Session
+{
+	uint32_t magic;
+	bool slaveMode;
+	NodeCaps caps;
+	uint16_t crc;
+};
+
+RTC_NOINIT_ATTR Session rtcSession;
+Session session; // as stored in NVS
+Preferences preferences;
+
+bool sessionValid(const Session &stored)
+{
+	return stored.magic == SESSION_MAGIC && stored.crc == crc16((const uint8_t *)&stored, offsetof(Session, crc));
+}
+
+void sessionSave(bool slaveMode)
+{
+	Session next;
+
+	memset(&next, 0, sizeof(next));
+	next.magic = SESSION_MAGIC;
+	next.slaveMode = slaveMode;
+	// Only caps where every node that answered, answered every read
+	if (slaveMode && caps.discovered && !caps.stale)
+		memcpy(&next.caps, &caps, sizeof(caps));
+	next.crc = crc16((const uint8_t *)&next, offsetof(Session, crc));
 
-		wheelCirc = (getValue(MOTOR, MOTOR_GEOMETRY_CIRC_HI) << 8) + getValue(MOTOR, MOTOR_GEOMETRY_CIRC_LO);
-		BTSerial.printf(" wheel circumference .....: %d mm" _NL _NL, wheelCirc);
+	memcpy(&rtcSession, &next, sizeof(next));
 
-		BTSerial.printf(" part number .............: %05d" _NL
-						" item number .............: %05d" _NL _NL,
-						((getValue(MOTOR, MOTOR_SN_PN_HI) << 8) + getValue(MOTOR, MOTOR_SN_PN_LO)),
-						((getValue(MOTOR, MOTOR_SN_ITEM_HI) << 8) + getValue(MOTOR, MOTOR_SN_ITEM_LO)));
+	if (memcmp(&next, &session, sizeof(next)) != 0)
+	{
+		preferences.putBytes("session", &next, sizeof(next));
+		memcpy(&session, &next, sizeof(next));
 	}
 }
 
+// Store the caps again after a new discovery, the slave mode stays as it was
+void sessionSaveCaps()
+{
+	sessionSave(session.slaveMode);
+}
+
+/*
+ * A single read checks that the console is still in slave mode, which also means
+ * the system was not power cycled in between, so the cached node data still
+ * holds. Otherwise the session is dropped and the nodes are discovered again.
+ */
+bool sessionProbe()
+{
+	BusOp probe = {CONSOLE_STATUS_SLAVE, 0, false, false};
+
+	if (runPipeline(CONSOLE, &probe, 1, true, PROBE_TIMEOUT_MS) && probe.value)
+		return true;
+
+	caps.discovered = false;
+	sessionSave(false);
+	return false;
+}
+
+// Resume the session of before the reset
+bool sessionRestore()
+{
+	Session stored;
+
+	preferences.begin("bxf");
+	if (preferences.getBytes("session", &session, sizeof(session)) != sizeof(session) || !sessionValid(session))
+		memset(&session, 0, sizeof(session));
+
+	if (sessionValid(rtcSession))
+		memcpy(&stored, &rtcSession, sizeof(stored));
+	else
+		memcpy(&stored, &session, sizeof(stored));
+
+	if (!stored.slaveMode)
+		return false;
+
+	if (!sessionProbe())
+		return false;
+
+	memcpy(&caps, &stored.caps, sizeof(caps));
+	selectReadPlans();
+	sessionSave(true);
+
+	return true;
+}
+
 void shutdown()
 {
 	BTSerial.println("Shutting the system down");
 	setValue(BATTERY, BATTERY_CONFIG_SHUTDOWN, 1);
+	sessionSave(false);
 }
 
 void packetCapture()
 {
 	BTSerial.println("Capturing packets...");
 
-	twai_message_t message;
+	CanFrame frame;
+	const twai_message_t &message = frame.message;
+
+	// Sleep until the next frame or the stop request, but stay at full clock
+	powerSetCanWake(CAN_WAKE_CAPTURE, true);
 
 	while (BTSerial.available() == 0)
 	{
-		if (twai_receive(&message, pdMS_TO_TICKS(1000)) == ESP_OK)
+		while (BTSerial.available() == 0 && xQueueReceive(rxQueue, &frame, 0) == pdTRUE)
 		{
-
 			BTSerial.printf("\nPacket from: %s\n", getNodeName(message.identifier));
 
 			for (int i = 0; i < message.data_length_code; i++)
@@ -450,57 +1923,107 @@ void packetCapture()
 			}
 
 			BTSerial.println();
+
+			// Live decoding only shows the changes
+			if (shadow.live)
+				sniffShow(frame);
+			else if (frame.node >= 0)
+				printShadowValue(frame.node, message.data[1]);
 		}
+
+		powerIdleWait(IDLE_WAKE_MS, true);
 	}
 
+	powerSetCanWake(CAN_WAKE_CAPTURE, false);
 	BTSerial.readString();
 
 	BTSerial.println("Done capturing packets");
 }
 
-void setup()
+const char *startCan()
 {
-	BTSerial.begin(115200);
-	// Wait for Bluetooth serial to connect before doing anything
-	while (!BTSerial.connected())
-		;
-
 	// Initialize configuration structures using macro initializers
 	twai_general_config_t g_config = TWAI_GENERAL_CONFIG_DEFAULT(GPIO_NUM_5, GPIO_NUM_4, TWAI_MODE_NORMAL);
+	// Pipelined reads get their replies in bursts, the receive task empties it as they come
+	g_config.rx_queue_len = 32;
 	twai_timing_config_t t_config = TWAI_TIMING_CONFIG_125KBITS();
 	twai_filter_config_t f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
 
 	// Install TWAI driver
-	if (twai_driver_install(&g_config, &t_config, &f_config) == ESP_OK)
-	{
-		BTSerial.printf("CAN driver installed\n");
-	}
-	else
-	{
-		BTSerial.printf("Failed to install the CAN driver\n");
-		return;
-	}
+	if (twai_driver_install(&g_config, &t_config, &f_config) != ESP_OK)
+		return "Failed to install the CAN driver";
 
 	// Start TWAI driver
-	if (twai_start() == ESP_OK)
-	{
-		BTSerial.printf("CAN driver started\n");
-	}
-	else
+	if (twai_start() != ESP_OK)
+		return "Failed to start the CAN driver";
+
+	rxQueue = xQueueCreate(RX_QUEUE_LEN, sizeof(CanFrame));
+	xTaskCreate(canRxTask, "canRx", 3072, NULL, 5, NULL);
+
+	return NULL;
+}
+
+const char *canError;
+uint32_t readyMs;
+
+// Printed whenever a client connects, after the session was probed again
+void printWelcome()
+{
+	if (canError)
 	{
-		BTSerial.printf("Failed to start the CAN driver\n");
+		BTSerial.printf("%s\n", canError);
 		return;
 	}
 
-	BTSerial.printf("Welcome. Before giving any commands put the console into slave mode using n. Send h for help.");
+	BTSerial.printf("CAN driver started\n");
+
+	if (session.slaveMode)
+		BTSerial.printf("Session resumed, console in slave mode. Ready %u ms after boot. Send h for help." _NL, (unsigned int)readyMs);
+	else
+		BTSerial.printf("Welcome. Before giving any commands put the console into slave mode using n. Send h for help.");
+}
+
+void setup()
+{
+	loopTask = xTaskGetCurrentTaskHandle();
+	BTSerial.register_callback(bluetoothEvent);
+	BTSerial.begin(115200);
+	BTSerial.setTimeout(COMMAND_TIMEOUT_MS);
+
+	// Bring up the bus and resume the session while the client is still connecting
+	shadowInit();
+	canError = startCan();
+	if (!canError)
+		sessionRestore();
+	readyMs = millis();
+
+	// Wait for Bluetooth serial to connect before doing anything
+	while (!BTSerial.connected())
+		powerIdleWait(IDLE_WAKE_MS);
 }
 
 void loop()
 {
+	if (clientConnected)
+	{
+		clientConnected = false;
+		// The system may have been power cycled while no client was connected
+		if (!canError && session.slaveMode)
+			sessionProbe();
+		printWelcome();
+	}
+
 	// Get commands from BTSerial
-	while (BTSerial.available() == 0)
-		;
-	String command = BTSerial.readString();
+	while (BTSerial.available() == 0 && !clientConnected)
+	{
+		rxDrain();
+		// Streaming, sampling or live decoding, keep the full clock like a capture
+		powerIdleWait(monitorStep(), monitor.active || shadow.live);
+	}
+	if (!BTSerial.available())
+		return;
+
+	String command = BTSerial.readStringUntil('\n');
 	command.trim();
 
 	int space = command.indexOf(' ');
@@ -518,6 +2041,30 @@ void loop()
 		case 'i':
 			packetCapture();
 			break;
+		case 'w':
+			printPowerStats();
+			break;
+		case 'r':
+			if (monitor.active)
+				monitorStop();
+			else
+				monitorStart(MONITOR_PERIOD_MS);
+			break;
+		case 'e':
+			printMetrics();
+			break;
+		case 'q':
+			printTxStats();
+			break;
+		case 'x':
+			exportBatteryStats(false);
+			break;
+		case 'd':
+			sniffToggleLive();
+			break;
+		case 'v':
+			printShadow();
+			break;
 		case 'n':
 		{
 			int consoleInSlaveMode = getValue(CONSOLE, CONSOLE_STATUS_SLAVE);
@@ -546,6 +2093,11 @@ void loop()
 				else
 					BTSerial.printf("console not in slave mode" _NL _NL);
 			}
+
+			// The node versions only have to be read again after (re)connecting
+			if (consoleInSlaveMode)
+				discoverNodes();
+			sessionSave(consoleInSlaveMode);
 		}
 		default:
 			usage();
@@ -561,6 +2113,41 @@ void loop()
 	int doShutdown = 0;
 	switch (action)
 	{
+	case 'x':
+	{
+		if (value_string != "b")
+		{
+			BTSerial.printf("ERROR: Unknown export format %s." _NL, value_string.c_str());
+			return;
+		}
+
+		exportBatteryStats(true);
+		break;
+	}
+	case 'r':
+	{
+		int period = value_string.toInt();
+		if (period < MONITOR_MIN_PERIOD_MS)
+		{
+			BTSerial.printf("ERROR: Monitor period %d is below " __STR(MONITOR_MIN_PERIOD_MS) " ms." _NL, period);
+			return;
+		}
+
+		monitorStart(period);
+		break;
+	}
+	case 'e':
+	{
+		int samples = value_string.toInt();
+		if (samples < 1 || samples > METRICS_WINDOW)
+		{
+			BTSerial.printf("ERROR: Metrics window %d is out of range." _NL, samples);
+			return;
+		}
+
+		printMetrics(samples);
+		break;
+	}
 	case 'l':
 	{
 		float speedLimit = value_string.toFloat();